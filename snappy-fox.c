@@ -16,17 +16,33 @@
  * this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #define MAX_COMPRESSED_DATA_SIZE   16777211
 #define MAX_UNCOMPRESSED_DATA_SIZE 65536
+/* Granularity of the holes left in sparse output files */
+#define SPARSE_BLOCK_SIZE          4096
+/* Compressed bytes tried before and after the point of failure */
+#define REPAIR_WINDOW_BEFORE       64
+#define REPAIR_WINDOW_AFTER        5
+#define REPAIR_MAX_THREADS         64
+/* Default output bytes between two checkpoints, each one syncs the output */
+#define CHECKPOINT_BYTES           (1ull << 30)
+#define CHECKPOINT_VERSION         2
 
 #ifdef DEBUG
 #define prdebug(f...) fprintf(stderr, "[ DEBUG ]"), fprintf(stderr, f)
@@ -37,6 +53,7 @@
 #endif
 #define prbanner(f...) fprintf(stderr, f)
 #define prerror(f...)  fprintf(stderr, "[ ERROR ]"), fprintf(stderr, f)
+#define prrepair(f...) fprintf(stderr, "[ REPAIR]"), fprintf(stderr, f)
 
 #ifndef VERSION
 #define VERSION "unknown"
@@ -57,6 +74,58 @@ static uint32_t read_offset = 0;
 static uint32_t consider_crc_errors = 0;
 /* Use Firefox CRC32 implementation */
 static uint32_t firefox_crc = 0;
+/* Leave holes in the output file instead of writing zeroed blocks */
+static uint32_t sparse_output = 0;
+/* Decompress directly in a mapping of the output file */
+static uint32_t mapped_output = 0;
+/* File where the substituted (corrupted) output regions are listed */
+static const char *corruption_list_path = NULL;
+/* Search a repair for corrupted chunks */
+static uint32_t repair_chunks = 0;
+/* Time budget for the repair of a single chunk, in milliseconds */
+static uint32_t repair_budget_ms = 1000;
+/* A repair is being searched: offset errors are fatal and silent */
+static uint32_t repair_pass = 0;
+/* Decompressed chunks so far, and those whose CRC matched */
+static uint32_t crc_checked_chunks = 0;
+static uint32_t crc_matched_chunks = 0;
+static uint32_t crc_repair_warned = 0;
+/* Output bytes between two checkpoints, 0 disables checkpoints */
+static uint64_t checkpoint_bytes = 0;
+/* Resume the decompression from the last checkpoint */
+static uint32_t resume = 0;
+/* Checkpoint file, next to the output file */
+static char *checkpoint_path = NULL;
+/* Size of the corruption list at the resumed checkpoint, -1 if none */
+static off_t checkpoint_list_size = -1;
+
+/* Output state */
+/* Number of bytes produced so far in the output file */
+static off_t output_offset = 0;
+/* Standard CRC32C of the produced output, kept only for checkpoints */
+static uint32_t output_crc = 0;
+/* Output is a file opened by snappy-fox, see is_owned_output */
+static uint32_t output_owned = 0;
+/* Output has a trailing hole which is not yet reflected in its size */
+static uint32_t output_hole_pending = 0;
+/* Output is a regular file which can be decompressed in place */
+static uint32_t output_mappable = 0;
+/* Mapping of the output file, NULL when writing through stdio */
+static uint8_t *output_map = NULL;
+static size_t output_map_size = 0;
+static int output_fd = -1;
+/* Corrupted output region not yet written in the corruption list */
+static FILE *corruption_list = NULL;
+static off_t corrupted_start = 0;
+static off_t corrupted_length = 0;
+/* Regions of the chunk being decompressed, listed once it is written */
+struct corrupted_region {
+    off_t start;
+    off_t length;
+};
+static struct corrupted_region *pending_regions = NULL;
+static size_t pending_regions_count = 0;
+static size_t pending_regions_size = 0;
 
 /* CRC related functions */
 static const uint32_t crc32c_table[] = {
@@ -142,6 +211,284 @@ static void crc32c_fini(uint32_t *crc) {
 	*crc = ((*crc >> 15) | (*crc << 17)) + 0xa282ead8;
 }
 
+/* Get back the standard CRC32C from a value returned by crc32c_fini */
+static uint32_t crc32c_unmask(uint32_t crc) {
+	crc -= 0xa282ead8;
+	crc = (crc << 15) | (crc >> 17);
+	if (firefox_crc)
+		crc ^= 0xffffffff;
+	return crc;
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+	uint32_t sum = 0;
+	for (; vec != 0; vec >>= 1, mat++) {
+		if (vec & 1)
+			sum ^= *mat;
+	}
+	return sum;
+}
+
+/* res = a * b, res must not alias the operands */
+static void gf2_matrix_mul(uint32_t *res, const uint32_t *a, const uint32_t *b) {
+	int n = 0;
+	for (n = 0; n < 32; ++n)
+		res[n] = gf2_matrix_times(a, b[n]);
+}
+
+/* Operators appending 2^n zero bytes to a standard CRC32C */
+static uint32_t crc32c_zeros_ops[32][32];
+static uint32_t crc32c_zeros_ready = 0;
+
+static void crc32c_zeros_init(void) {
+	int n = 0;
+	uint32_t bit[32];
+	uint32_t tmp[32];
+
+	/* One zero bit */
+	bit[0] = 0x82f63b78;
+	for (n = 1; n < 32; ++n)
+		bit[n] = 1u << (n - 1);
+
+	/* Two, four, then eight zero bits */
+	gf2_matrix_mul(tmp, bit, bit);
+	gf2_matrix_mul(bit, tmp, tmp);
+	gf2_matrix_mul(crc32c_zeros_ops[0], bit, bit);
+
+	for (n = 1; n < 32; ++n)
+		gf2_matrix_mul(crc32c_zeros_ops[n], crc32c_zeros_ops[n - 1],
+		               crc32c_zeros_ops[n - 1]);
+
+	crc32c_zeros_ready = 1;
+}
+
+/* Standard CRC32C of the concatenation of two buffers */
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint32_t len2) {
+	int n = 0;
+
+	if (!crc32c_zeros_ready)
+		crc32c_zeros_init();
+
+	for (n = 0; len2 != 0; ++n, len2 >>= 1) {
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(crc32c_zeros_ops[n], crc1);
+	}
+	return crc1 ^ crc2;
+}
+
+/* Corruption list related functions */
+static void flush_corrupted_region(void) {
+    if (corruption_list == NULL || corrupted_length == 0)
+        return;
+
+    fprintf(corruption_list, "%lld %lld\n",
+            (long long) corrupted_start, (long long) corrupted_length);
+    corrupted_length = 0;
+}
+
+static void list_corrupted_region(off_t start, off_t length) {
+    /* Merge adjacent substitutions in a single region */
+    if (corrupted_length != 0 &&
+        corrupted_start + corrupted_length == start) {
+        corrupted_length += length;
+        return;
+    }
+
+    flush_corrupted_region();
+    corrupted_start  = start;
+    corrupted_length = length;
+}
+
+static void record_corrupted_region(off_t start, off_t length) {
+    size_t size = 0;
+    struct corrupted_region *regions = NULL;
+    struct corrupted_region *last = NULL;
+
+    if (corruption_list == NULL || length == 0)
+        return;
+
+    if (pending_regions_count > 0) {
+        last = &pending_regions[pending_regions_count - 1];
+        if (last->start + last->length == start) {
+            last->length += length;
+            return;
+        }
+    }
+
+    if (pending_regions_count == pending_regions_size) {
+        size = pending_regions_size ? 2 * pending_regions_size : 16;
+        regions = realloc(pending_regions, size * sizeof(*regions));
+        if (regions == NULL) {
+            prerror("Cannot record corrupted region %lld %lld\n",
+                    (long long) start, (long long) length);
+            return;
+        }
+        pending_regions = regions;
+        pending_regions_size = size;
+    }
+
+    pending_regions[pending_regions_count].start  = start;
+    pending_regions[pending_regions_count].length = length;
+    pending_regions_count++;
+}
+
+/* The output of the chunk has been written, list its regions */
+static void commit_corrupted_regions(void) {
+    size_t i = 0;
+    for (i = 0; i < pending_regions_count; ++i)
+        list_corrupted_region(pending_regions[i].start,
+                              pending_regions[i].length);
+    pending_regions_count = 0;
+}
+
+/* The chunk has been rejected, nothing of it reached the output */
+static void discard_corrupted_regions(void) {
+    pending_regions_count = 0;
+}
+
+/* Output related functions */
+static int is_zero_block(const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (i = 0; i < len; ++i) {
+        if (data[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Map the output file, sized for size bytes of output plus a chunk of slack.
+ * The file is truncated to the produced output in unmap_output.
+ */
+static int map_output(FILE *out, off_t size) {
+    int fd = fileno(out);
+    uint8_t *map = NULL;
+
+    size += MAX_UNCOMPRESSED_DATA_SIZE;
+    if ((off_t)(size_t) size != size)
+        return -1;
+
+    /* Map first, the file is left untouched if the mapping fails */
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* Reserve the blocks at once, the file is not extended piecewise */
+    if (posix_fallocate(fd, 0, size) != 0) {
+        munmap(map, size);
+        return -1;
+    }
+
+    if (output_map != NULL)
+        munmap(output_map, output_map_size);
+
+    output_map = map;
+    output_map_size = size;
+    output_fd = fd;
+    prinfo("Output mapped, %zu bytes\n", output_map_size);
+    return 0;
+}
+
+/* Mapped output area for the next len bytes, the mapping grows if needed */
+static uint8_t *output_window(FILE *out, size_t len) {
+    off_t size = output_offset + len;
+
+    if (size > output_map_size) {
+        /* Grow geometrically when the size estimation was short */
+        if (size < 2 * (off_t) output_map_size)
+            size = 2 * (off_t) output_map_size;
+        if (map_output(out, size) != 0)
+            return NULL;
+    }
+    return output_map + output_offset;
+}
+
+static int unmap_output(void) {
+    int ret = 0;
+
+    if (output_map == NULL)
+        return 0;
+
+    if (munmap(output_map, output_map_size) != 0)
+        ret = -1;
+    /* Drop the slack and what the size estimation got wrong */
+    if (ftruncate(output_fd, output_offset) != 0)
+        ret = -1;
+
+    output_map = NULL;
+    output_map_size = 0;
+    output_fd = -1;
+    return ret;
+}
+
+static int write_output(FILE *out, const uint8_t *data, size_t len) {
+    size_t towrite = 0;
+    uint8_t *dst = NULL;
+    off_t pos = 0;
+
+    if (output_map != NULL) {
+        dst = output_window(out, len);
+        if (dst == NULL)
+            return -1;
+        /* Usually the data has been decompressed in place */
+        if (dst != data)
+            memcpy(dst, data, len);
+        output_offset += len;
+        return 0;
+    }
+
+    if (!sparse_output) {
+        if (fwrite(data, 1, len, out) != len)
+            return -1;
+        output_offset += len;
+        return 0;
+    }
+
+    /* Align the holes on the real position in the file */
+    pos = ftello(out);
+    if (pos < 0)
+        return -1;
+
+    while (len > 0) {
+        /* Stop at the next block boundary of the output file */
+        towrite = SPARSE_BLOCK_SIZE - (pos % SPARSE_BLOCK_SIZE);
+        if (towrite > len)
+            towrite = len;
+
+        if (towrite == SPARSE_BLOCK_SIZE && is_zero_block(data, towrite)) {
+            /* Leave a hole, the file size is fixed in finalize_output */
+            if (fseeko(out, towrite, SEEK_CUR) != 0)
+                return -1;
+            output_hole_pending = 1;
+        } else {
+            if (fwrite(data, 1, towrite, out) != towrite)
+                return -1;
+            output_hole_pending = 0;
+        }
+
+        output_offset += towrite;
+        pos  += towrite;
+        data += towrite;
+        len  -= towrite;
+    }
+    return 0;
+}
+
+static int finalize_output(FILE *out) {
+    off_t pos = 0;
+
+    if (!output_hole_pending)
+        return 0;
+
+    /* Extend the file over the trailing hole, up to the write position */
+    if (fflush(out) != 0 || (pos = ftello(out)) < 0 ||
+        ftruncate(fileno(out), pos) != 0)
+        return -1;
+
+    output_hole_pending = 0;
+    return 0;
+}
+
 /* Logarithm base two of the number */
 static uint32_t log2_32(uint32_t n) {
     int32_t i = 0;
@@ -246,12 +593,14 @@ static int offsetread(uint8_t *data, uint32_t *idx, uint32_t length,
         ret = -1;
 
     /* Check if we can ignore errors */
-    if (ret != 0 && !ignore_offset_errors) {
-        prerror("Offset error\n");
+    if (ret != 0 && (!ignore_offset_errors || repair_pass)) {
+        if (!repair_pass)
+            prerror("Offset error\n");
     } else if (ret != 0 && ignore_offset_errors) {
         prinfo("Ignoring offset errors\n");
         for (i = 0; i < clen; ++i)
             data[*idx+i] = offset_dummy_byte;
+        record_corrupted_region(output_offset + *idx, clen);
         *idx = *idx + clen;
         ret = 0;
     } else if (coff >= clen) {
@@ -338,8 +687,9 @@ static int32_t parse_compressed_type(uint8_t compressed_type,
     }
 }
 
-static int snappy_uncompress(FILE *out, uint8_t *cdata, size_t clength,
-        uint8_t *data, size_t length, uint32_t *idx, uint32_t *crc) {
+static int snappy_uncompress(uint8_t *cdata, size_t clength,
+        uint8_t *data, size_t length, uint32_t *idx, uint32_t *crc,
+        uint32_t *err_cidx) {
     int32_t  off = 0;
     uint32_t cidx  = 0;
     uint32_t bytes = 0;
@@ -358,6 +708,7 @@ static int snappy_uncompress(FILE *out, uint8_t *cdata, size_t clength,
         return -1;
 
     cidx = bytes;
+    *err_cidx = 0;
 
     while (cidx < clength && *idx < length) {
         ctype = cdata[cidx] & 0x03;
@@ -368,8 +719,7 @@ static int snappy_uncompress(FILE *out, uint8_t *cdata, size_t clength,
             /* Calculate CRC */
             crc32c(crc, data, *idx);
             crc32c_fini(crc);
-            if (fwrite(data, 1, *idx, out) !=  *idx)
-                return off;
+            *err_cidx = cidx;
             return off;
         }
 
@@ -383,6 +733,244 @@ static int snappy_uncompress(FILE *out, uint8_t *cdata, size_t clength,
     return 0;
 }
 
+/* Repair related functions */
+struct repair_search {
+    const uint8_t *cdata;
+    uint32_t clength;
+    /* Candidate positions, tried starting from focus */
+    uint32_t start;
+    uint32_t focus;
+    uint32_t end;
+    uint32_t expected_crc;
+    uint32_t nthreads;
+    uint64_t ncandidates;
+    struct timespec deadline;
+
+    pthread_mutex_t lock;
+    /* Lowest candidate matching the expected CRC */
+    uint64_t found;
+    uint32_t timed_out;
+};
+
+struct repair_worker {
+    struct repair_search *search;
+    uint32_t id;
+    pthread_t thread;
+};
+
+static uint32_t popcount8(uint8_t v) {
+    uint32_t n = 0;
+    for (; v != 0; v &= v - 1)
+        n++;
+    return n;
+}
+
+static uint32_t repair_position(const struct repair_search *s, uint32_t i) {
+    /* From the focus to the end, then backwards from the focus */
+    if (i < s->end - s->focus)
+        return s->focus + i;
+    return s->focus - 1 - (i - (s->end - s->focus));
+}
+
+/*
+ * Candidate k is a bit flip for k < 8 * window, then a byte substitution.
+ * Substitutions already covered by a bit flip are skipped.
+ */
+static int repair_candidate(const struct repair_search *s, uint64_t k,
+                            uint32_t *pos, uint8_t *val) {
+    uint64_t window = s->end - s->start;
+    uint8_t orig = 0;
+
+    if (k < 8 * window) {
+        *pos = repair_position(s, k / 8);
+        *val = s->cdata[*pos] ^ (1 << (k % 8));
+        return 1;
+    }
+
+    k -= 8 * window;
+    *pos = repair_position(s, k / 256);
+    *val = k % 256;
+    orig = s->cdata[*pos];
+    return popcount8(orig ^ *val) > 1;
+}
+
+static int deadline_expired(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void *repair_thread(void *arg) {
+    struct repair_worker *w = arg;
+    struct repair_search *s = w->search;
+    uint8_t *cdata = NULL;
+    uint8_t *data  = NULL;
+    uint64_t k = 0;
+    uint64_t tried = 0;
+    uint32_t pos = 0;
+    uint32_t idx = 0;
+    uint32_t crc = 0;
+    uint32_t err_cidx = 0;
+    uint8_t  val = 0;
+    uint8_t  orig = 0;
+    int stop = 0;
+
+    /* Literals may be read past the end of the chunk */
+    cdata = calloc(1, s->clength + MAX_UNCOMPRESSED_DATA_SIZE + 8);
+    if (cdata == NULL)
+        goto exit_point;
+
+    data = malloc(MAX_UNCOMPRESSED_DATA_SIZE);
+    if (data == NULL)
+        goto free_cdata;
+
+    memcpy(cdata, s->cdata, s->clength);
+
+    for (k = w->id; k < s->ncandidates; k += s->nthreads, ++tried) {
+        pthread_mutex_lock(&s->lock);
+        if (k > s->found || s->timed_out) {
+            stop = 1;
+        } else if (tried % 16 == 0 && deadline_expired(&s->deadline)) {
+            s->timed_out = 1;
+            stop = 1;
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
+
+        if (!repair_candidate(s, k, &pos, &val))
+            continue;
+
+        orig = cdata[pos];
+        cdata[pos] = val;
+        if (snappy_uncompress(cdata, s->clength, data,
+                              MAX_UNCOMPRESSED_DATA_SIZE, &idx, &crc,
+                              &err_cidx) == 0 &&
+            crc == s->expected_crc) {
+            pthread_mutex_lock(&s->lock);
+            if (k < s->found)
+                s->found = k;
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        cdata[pos] = orig;
+    }
+
+    free(data);
+free_cdata:
+    free(cdata);
+exit_point:
+    return NULL;
+}
+
+/* Whether a chunk which failed, or has a wrong CRC, is worth a repair search */
+static int repair_allowed(int failed) {
+    /* CRC errors alone are ignored anyway */
+    if (!failed && !consider_crc_errors)
+        return 0;
+
+    /* Most likely the wrong CRC algorithm, e.g. a missing --firefox */
+    if (crc_checked_chunks > 0 && crc_matched_chunks == 0) {
+        if (!crc_repair_warned)
+            prerror("Every chunk fails the CRC, not repairing chunks\n");
+        crc_repair_warned = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Search a single byte change of the compressed chunk which makes it
+ * decompress with the expected CRC. The candidates are tried in parallel,
+ * on success the chunk is fixed and decompressed in data.
+ */
+static int repair_chunk(uint8_t *cdata, uint32_t clength, int failed,
+                        uint32_t err_cidx, uint32_t expected_crc,
+                        uint8_t *data, uint32_t *idx, long chunk_offset) {
+    int ret = -1;
+    long ncpu = 0;
+    uint32_t i = 0;
+    uint32_t pos = 0;
+    uint32_t crc = 0;
+    uint8_t  val = 0;
+    struct repair_search s;
+    struct repair_worker workers[REPAIR_MAX_THREADS];
+
+    memset(&s, 0, sizeof(s));
+    s.cdata = cdata;
+    s.clength = clength;
+    s.expected_crc = expected_crc;
+    s.found = UINT64_MAX;
+
+    if (failed) {
+        /* The corruption is close before the element which failed */
+        s.focus = err_cidx < clength ? err_cidx : clength;
+        s.start = s.focus > REPAIR_WINDOW_BEFORE ?
+                  s.focus - REPAIR_WINDOW_BEFORE : 0;
+        s.end = clength - s.focus > REPAIR_WINDOW_AFTER ?
+                s.focus + REPAIR_WINDOW_AFTER : clength;
+    } else {
+        /* Only the CRC is wrong, the corruption can be anywhere */
+        s.start = 0;
+        s.focus = 0;
+        s.end = clength;
+    }
+    s.ncandidates = (uint64_t)(s.end - s.start) * (8 + 256);
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    s.nthreads = ncpu < 1 ? 1 : (ncpu > REPAIR_MAX_THREADS ?
+                                 REPAIR_MAX_THREADS : ncpu);
+
+    clock_gettime(CLOCK_MONOTONIC, &s.deadline);
+    s.deadline.tv_sec  += repair_budget_ms / 1000;
+    s.deadline.tv_nsec += (repair_budget_ms % 1000) * 1000000L;
+    if (s.deadline.tv_nsec >= 1000000000L) {
+        s.deadline.tv_sec++;
+        s.deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (pthread_mutex_init(&s.lock, NULL) != 0)
+        return -1;
+
+    for (i = 0; i < s.nthreads; ++i) {
+        workers[i].search = &s;
+        workers[i].id = i;
+    }
+
+    repair_pass = 1;
+    for (i = 0; i < s.nthreads; ++i) {
+        /* Search in this thread the candidates of a missing worker */
+        if (pthread_create(&workers[i].thread, NULL,
+                           repair_thread, &workers[i]) != 0) {
+            workers[i].thread = pthread_self();
+            repair_thread(&workers[i]);
+        }
+    }
+    for (i = 0; i < s.nthreads; ++i) {
+        if (!pthread_equal(workers[i].thread, pthread_self()))
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    if (s.found != UINT64_MAX) {
+        repair_candidate(&s, s.found, &pos, &val);
+        prrepair("chunk at %ld: repaired, byte %u %02x -> %02x\n",
+                 chunk_offset, pos, cdata[pos], val);
+        cdata[pos] = val;
+        ret = snappy_uncompress(cdata, clength, data,
+                                MAX_UNCOMPRESSED_DATA_SIZE, idx, &crc,
+                                &err_cidx);
+    } else {
+        prrepair("chunk at %ld: still corrupt%s\n", chunk_offset,
+                 s.timed_out ? " (time budget exhausted)" : "");
+    }
+    repair_pass = 0;
+
+    pthread_mutex_destroy(&s.lock);
+    return ret;
+}
+
 static FILE *open_read_file(const char *file) {
     FILE *in = stdin;
     if (strcmp(file, "-") != 0)
@@ -400,12 +988,40 @@ static FILE *open_read_file(const char *file) {
 
 static FILE *open_write_file(const char *file) {
     FILE *out = stdout;
+    /* Output files are opened for reading too, to be mapped */
+    /* Resumed output files are truncated after their validation */
     if (strcmp(file, "-") != 0)
-        out = fopen(file, "wb");
+        out = fopen(file, resume ? "r+b" : "w+b");
     prdebug("Opening OUT file: %s\n", file);
     return out;
 }
 
+static int is_regular_file(FILE *f) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0)
+        return 0;
+    return S_ISREG(st.st_mode);
+}
+
+/*
+ * Output file opened by snappy-fox, at its beginning and not appending:
+ * it can be seeked over, truncated and mapped without touching other data.
+ */
+static int is_owned_output(FILE *out) {
+    int flags = 0;
+
+    if (out == stdout || !is_regular_file(out) || ftello(out) != 0)
+        return 0;
+
+    flags = fcntl(fileno(out), F_GETFL);
+    return flags != -1 && !(flags & O_APPEND);
+}
+
+static int is_read_write(FILE *f) {
+    int flags = fcntl(fileno(f), F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) == O_RDWR;
+}
+
 static int close_file(FILE *f) {
     if (f == stdin || f == stdout)
         return 0;
@@ -413,6 +1029,173 @@ static int close_file(FILE *f) {
     return fclose(f);
 }
 
+/* Checkpoint related functions */
+static int write_checkpoint(FILE *in, FILE *out) {
+    int ret = 0;
+    FILE *f = NULL;
+    char *tmp_path = NULL;
+    off_t in_offset = ftello(in);
+    off_t list_size = -1;
+
+    /* The checkpointed output must be on disk before the checkpoint */
+    if (finalize_output(out) != 0 || fflush(out) != 0)
+        return -1;
+    if (output_map != NULL &&
+        msync(output_map, output_offset, MS_SYNC) != 0)
+        return -1;
+    if (fsync(fileno(out)) != 0)
+        return -1;
+
+    /* So must be the regions listed up to here */
+    if (corruption_list != NULL) {
+        flush_corrupted_region();
+        if (fflush(corruption_list) != 0 ||
+            fsync(fileno(corruption_list)) != 0 ||
+            (list_size = ftello(corruption_list)) < 0)
+            return -1;
+    }
+
+    tmp_path = malloc(strlen(checkpoint_path) + 5);
+    if (tmp_path == NULL)
+        return -1;
+    sprintf(tmp_path, "%s.tmp", checkpoint_path);
+
+    f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        ret = -1;
+        goto free_path;
+    }
+
+    fprintf(f, "snappy-fox checkpoint %d\n%lld %lld %08x %lld\n",
+            CHECKPOINT_VERSION, (long long) in_offset,
+            (long long) output_offset, output_crc, (long long) list_size);
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        ret = -1;
+        goto free_path;
+    }
+
+    if (fclose(f) != 0) {
+        ret = -1;
+        goto free_path;
+    }
+
+    /* Replace the previous checkpoint atomically */
+    if (rename(tmp_path, checkpoint_path) != 0)
+        ret = -1;
+
+    prinfo("Checkpoint in: %lld out: %lld\n",
+           (long long) in_offset, (long long) output_offset);
+
+free_path:
+    free(tmp_path);
+    return ret;
+}
+
+static int resume_checkpoint(FILE *in, FILE *out) {
+    int ret = 0;
+    int version = 0;
+    FILE *f = NULL;
+    uint8_t *buf = NULL;
+    long long in_offset = 0;
+    long long out_offset = 0;
+    long long list_size = -1;
+    off_t left = 0;
+    size_t toread = 0;
+    uint32_t crc = 0;
+    uint32_t prefix_crc = 0;
+
+    f = fopen(checkpoint_path, "r");
+    if (f == NULL) {
+        perror("fopen checkpoint");
+        return -1;
+    }
+
+    if (fscanf(f, "snappy-fox checkpoint %d %lld %lld %x %lld",
+               &version, &in_offset, &out_offset, &crc, &list_size) != 5 ||
+        version != CHECKPOINT_VERSION || in_offset < 0 || out_offset < 0) {
+        prerror("Invalid checkpoint %s\n", checkpoint_path);
+        ret = -1;
+        goto close_checkpoint;
+    }
+
+    buf = malloc(MAX_UNCOMPRESSED_DATA_SIZE);
+    if (buf == NULL) {
+        ret = -1;
+        goto close_checkpoint;
+    }
+
+    /* Validate the output written before the checkpoint */
+    crc32c_init(&prefix_crc);
+    for (left = out_offset; left > 0; left -= toread) {
+        toread = left < MAX_UNCOMPRESSED_DATA_SIZE ?
+                 left : MAX_UNCOMPRESSED_DATA_SIZE;
+        if (fread(buf, 1, toread, out) != toread) {
+            prerror("Output file is shorter than the checkpoint\n");
+            ret = -1;
+            goto free_buf;
+        }
+        crc32c(&prefix_crc, buf, toread);
+    }
+    prefix_crc ^= 0xffffffff;
+
+    if (prefix_crc != crc) {
+        prerror("Output file does not match the checkpoint: "
+                "expected CRC %08x calculated CRC %08x\n", crc, prefix_crc);
+        ret = -1;
+        goto free_buf;
+    }
+
+    /* Drop the output produced after the checkpoint */
+    if (fflush(out) != 0 || ftruncate(fileno(out), out_offset) != 0 ||
+        fseeko(out, out_offset, SEEK_SET) != 0 ||
+        fseeko(in, in_offset, SEEK_SET) != 0) {
+        perror("resume");
+        ret = -1;
+        goto free_buf;
+    }
+
+    output_offset = out_offset;
+    output_crc = crc;
+    checkpoint_list_size = list_size;
+    prbanner("Resuming from input offset %lld, output offset %lld\n",
+             in_offset, out_offset);
+
+free_buf:
+    free(buf);
+close_checkpoint:
+    fclose(f);
+    return ret;
+}
+
+static int setup_checkpoint(const char *out_file, FILE *in, FILE *out) {
+    if (unframed_stream) {
+        prerror("Checkpoints are supported only for framed streams\n");
+        return -1;
+    }
+
+    /*
+     * Both the offsets must be seekable to resume, and the output offset
+     * must be the position in a file opened by snappy-fox (not stdout)
+     */
+    if (!is_regular_file(in) || !output_owned) {
+        prerror("Checkpoints need a regular input file and an output file "
+                "opened by snappy-fox\n");
+        return -1;
+    }
+
+    checkpoint_path = malloc(strlen(out_file) + 12);
+    if (checkpoint_path == NULL)
+        return -1;
+    sprintf(checkpoint_path, "%s.checkpoint", out_file);
+
+    if (resume)
+        return resume_checkpoint(in, out);
+
+    return 0;
+}
+
 static uint8_t get_chunktype(FILE *in) {
     uint8_t chunktype;
     if (fread(&chunktype, 1, 1, in) != 1)
@@ -446,7 +1229,11 @@ static int parse_compressed_data_chunk(FILE *in, FILE *out) {
     uint32_t c_read_length = 0;
     uint32_t crc = 0;
     uint32_t idx = 0;
+    uint32_t err_cidx = 0;
     uint32_t uncompressed_crc = 0;
+    long chunk_offset = ftell(in) - 1;
+    /* Decompress directly in the output file when it is mapped */
+    int in_place = output_map != NULL;
 
     c_data = malloc(MAX_COMPRESSED_DATA_SIZE);
     if (c_data == NULL) {
@@ -454,7 +1241,10 @@ static int parse_compressed_data_chunk(FILE *in, FILE *out) {
         goto exit_point;
     }
 
-    data = malloc(MAX_UNCOMPRESSED_DATA_SIZE);
+    if (in_place)
+        data = output_window(out, MAX_UNCOMPRESSED_DATA_SIZE);
+    else
+        data = malloc(MAX_UNCOMPRESSED_DATA_SIZE);
     if (data == NULL) {
         ret = -1;
         goto free_c_data;
@@ -494,14 +1284,38 @@ static int parse_compressed_data_chunk(FILE *in, FILE *out) {
 
     c_read_length = fread(c_data, 1, c_length - 3, in);
 
-    if ((ret = snappy_uncompress(out, c_data, c_read_length,
-                         data, MAX_UNCOMPRESSED_DATA_SIZE, &idx,
-                         &uncompressed_crc)) != 0) {
+    /* Offset errors are not substituted until a repair has been tried */
+    repair_pass = repair_chunks;
+    ret = snappy_uncompress(c_data, c_read_length,
+                            data, MAX_UNCOMPRESSED_DATA_SIZE, &idx,
+                            &uncompressed_crc, &err_cidx);
+    repair_pass = 0;
+
+    if (repair_chunks && (ret != 0 || crc != uncompressed_crc) &&
+        repair_allowed(ret != 0) &&
+        repair_chunk(c_data, c_read_length, ret != 0, err_cidx, crc,
+                     data, &idx, chunk_offset) == 0) {
+        ret = 0;
+        uncompressed_crc = crc;
+    } else if (repair_chunks && ret != 0 && ignore_offset_errors) {
+        /* Substitute the corrupted values as without repairs */
+        ret = snappy_uncompress(c_data, c_read_length,
+                                data, MAX_UNCOMPRESSED_DATA_SIZE, &idx,
+                                &uncompressed_crc, &err_cidx);
+    }
+
+    if (ret != 0) {
+        /* Write what has been decompressed before the error */
+        if (write_output(out, data, idx) == 0)
+            commit_corrupted_regions();
         goto return_point;
     }
 
 
     prinfo("End of decompression %lx\n", ftell(in));
+    crc_checked_chunks++;
+    if (crc == uncompressed_crc)
+        crc_matched_chunks++;
     if (crc != uncompressed_crc) {
         prinfo("Corrupted File! Expected CRC: %08x Calculated CRC: %08x\n", crc, uncompressed_crc);
         if (consider_crc_errors) {
@@ -510,14 +1324,22 @@ static int parse_compressed_data_chunk(FILE *in, FILE *out) {
 	}
     }
 
-    if (fwrite(data, 1, idx, out) < idx) {
+    if (write_output(out, data, idx) != 0) {
         perror("fwrite");
         ret = -1;
         goto return_point;
     }
+    commit_corrupted_regions();
+
+    if (checkpoint_bytes != 0)
+        output_crc = crc32c_combine(output_crc,
+                                    crc32c_unmask(uncompressed_crc), idx);
 
 return_point:
-    free(data);
+    /* Regions of a rejected chunk were never written */
+    discard_corrupted_regions();
+    if (!in_place)
+        free(data);
 free_c_data:
     free(c_data);
 exit_point:
@@ -558,11 +1380,53 @@ static int parse_chunk(FILE *in, FILE *out, uint8_t chunktype) {
     }
 }
 
+/* Size of the output of an unframed stream, walking only its tags */
+static uint32_t unframed_output_length(const uint8_t *inbuf, uint32_t size,
+                                       uint32_t limit) {
+    uint32_t i = 0;
+    uint32_t clen = 0;
+    uint32_t bytes_to_read = 0;
+    uint64_t total = 0;
+
+    while (i < size && total < limit) {
+        switch (inbuf[i] & 0x03) {
+            case 0:
+                clen = (uint32_t)(inbuf[i] & 0xfc) >> 2;
+                bytes_to_read = 0;
+                if (clen >= 60) {
+                    bytes_to_read = clen - 59;
+                    if (i + 1 + bytes_to_read > size)
+                        return total;
+                    clen = 0;
+                    memcpy(&clen, &inbuf[i + 1], bytes_to_read);
+                }
+                clen += 1;
+                total += clen;
+                i += clen + bytes_to_read + 1;
+                break;
+            case 1:
+                total += ((uint32_t)(inbuf[i] & 0x1c) >> 2) + 4;
+                i += 2;
+                break;
+            case 2:
+                total += ((uint32_t)(inbuf[i] & 0xfc) >> 2) + 1;
+                i += 3;
+                break;
+            case 3:
+                total += ((uint32_t)(inbuf[i] & 0xfc) >> 2) + 1;
+                i += 5;
+                break;
+        }
+    }
+    return total < limit ? total : limit;
+}
+
 static int snappy_decompress_unframed(FILE *in, FILE *out) {
     int ret = 0;
     int32_t r = 0;
     uint32_t read_head = 0;
     uint32_t write_head = 0;
+    int in_place = 0;
 
     uint8_t *inbuf, *outbuf;
 
@@ -575,16 +1439,25 @@ static int snappy_decompress_unframed(FILE *in, FILE *out) {
         goto return_point;
     }
 
-    outbuf = malloc(write_size);
-    if (outbuf == NULL) {
-        ret = -1;
-        goto free_in;
-    }
-
     read_size = fread(inbuf, 1, read_size, in);
     if (read_size <= 0) {
         ret = read_size;
-        goto free_out;
+        goto free_in;
+    }
+
+    /* Decompress directly in the output file, sized by a tag prescan */
+    if (output_mappable) {
+        write_size = unframed_output_length(inbuf, read_size, write_size);
+        in_place = map_output(out, write_size) == 0;
+    }
+
+    if (in_place)
+        outbuf = output_map;
+    else
+        outbuf = malloc(write_size);
+    if (outbuf == NULL) {
+        ret = -1;
+        goto free_in;
     }
 
     while (read_head < read_size) {
@@ -601,25 +1474,85 @@ static int snappy_decompress_unframed(FILE *in, FILE *out) {
         prinfo("offset: %u\n", read_head);
     }
 
-    r = fwrite(outbuf, 1, write_head, out);
-    if (r < 0)
-        ret = r;
+    if (write_output(out, outbuf, write_head) != 0)
+        ret = -1;
+    else
+        commit_corrupted_regions();
 
-free_out:
-    free(outbuf);
+    if (!in_place)
+        free(outbuf);
 free_in:
     free(inbuf);
 return_point:
     return ret;
 }
 
+/* Size of the output of a framed stream, from the chunk headers */
+static off_t framed_output_length(FILE *in) {
+    off_t start = ftello(in);
+    off_t total = 0;
+    int chunktype = 0;
+    uint32_t c_length = 0;
+    uint32_t len = 0;
+    uint32_t bytes = 0;
+    size_t header_length = 0;
+    /* CRC and uncompressed length varint */
+    uint8_t header[4 + 5];
+
+    while ((chunktype = fgetc(in)) != EOF) {
+        c_length = 0;
+        if (fread(&c_length, 1, 3, in) != 3)
+            break;
+
+        if (chunktype == 0xff) {
+            /* Read as a fixed size identifier by parse_stream_identifier */
+            if (fseeko(in, 6, SEEK_CUR) != 0)
+                break;
+            continue;
+        }
+
+        /* Other chunks are not sized, the mapping grows if needed */
+        if (chunktype != 0x00 || c_length < 5)
+            break;
+
+        memset(header, 0, sizeof(header));
+        header_length = c_length < sizeof(header) ? c_length : sizeof(header);
+        if (fread(header, 1, header_length, in) != header_length)
+            break;
+
+        bytes = 0;
+        len = get_length(&header[4], sizeof(header) - 4, &bytes);
+        if (len <= MAX_UNCOMPRESSED_DATA_SIZE)
+            total += len;
+
+        if (fseeko(in, (off_t) c_length - header_length, SEEK_CUR) != 0)
+            break;
+    }
+
+    clearerr(in);
+    if (fseeko(in, start, SEEK_SET) != 0)
+        return -1;
+
+    prinfo("Framed output length %lld\n", (long long) total);
+    return total;
+}
+
 static int snappy_decompress_framed(FILE *in, FILE *out) {
     int ret = 0;
     uint8_t chunktype;
+    off_t last_checkpoint = output_offset;
 
     while (feof(in) == 0 && ferror(in) == 0 && ret == 0) {
         chunktype = get_chunktype(in);
         ret = parse_chunk(in, out, chunktype);
+
+        /* Checkpoints are taken only at chunk boundaries */
+        if (ret == 0 && chunktype == 0x00 && checkpoint_bytes != 0 &&
+            (uint64_t)(output_offset - last_checkpoint) >= checkpoint_bytes) {
+            if ((ret = write_checkpoint(in, out)) != 0)
+                perror("checkpoint");
+            last_checkpoint = output_offset;
+        }
         prdebug("New run %ld %d %d\n", ftell(in), feof(in), ferror(in));
     }
 
@@ -639,7 +1572,13 @@ static void usage(const char *progname) {
     fprintf(stderr, "    -E --ignore_offset_errors [substitution byte] Ignore any offset errors that occurs\n");
     fprintf(stderr, "    -M --ignore_magic                             Ignore altered magic bytes (sNaPpY)\n");
     fprintf(stderr, "    -O --read_offset [offset]                     Start reading file from offset\n");
+    fprintf(stderr, "    -K --checkpoint [bytes]                       Write a checkpoint every 1 GiB (or given) of output\n");
+    fprintf(stderr, "    -L --corruption_list [file]                   List substituted output regions in file\n");
+    fprintf(stderr, "    -R --repair [budget ms]                       Search a repair for corrupted chunks\n");
+    fprintf(stderr, "    -S --sparse                                   Leave holes for zeroed output blocks\n");
     fprintf(stderr, "    -f --firefox                                  Use firefox's CRC algorithm\n");
+    fprintf(stderr, "    -m --mmap                                     Decompress in a mapping of the output file\n");
+    fprintf(stderr, "    -r --resume                                   Resume from the last checkpoint\n");
     fprintf(stderr, "    -u --unframed                                 Assume Unframed stream in input file\n");
     fprintf(stderr, "    -h --help                                     This Help\n");
     fprintf(stderr, "    -v --version                                  Print Version and exit\n");
@@ -648,6 +1587,7 @@ static void usage(const char *progname) {
 int main(int argc, char **argv) {
     int c = 0;
     int ret = 0;
+    off_t total = 0;
     FILE *in, *out;
 
     int option_idx = 0;
@@ -656,7 +1596,13 @@ int main(int argc, char **argv) {
         {"ignore_offset_errors", optional_argument, 0, 'E'},
         {"ignore_magic",         no_argument,       0, 'M'},
         {"read_offset",          required_argument, 0, 'O'},
+        {"checkpoint",           optional_argument, 0, 'K'},
+        {"corruption_list",      required_argument, 0, 'L'},
+        {"repair",               optional_argument, 0, 'R'},
+        {"sparse",               no_argument,       0, 'S'},
         {"firefox",              no_argument,       0, 'f'},
+        {"mmap",                 no_argument,       0, 'm'},
+        {"resume",               no_argument,       0, 'r'},
         {"unframed",             no_argument,       0, 'u'},
         {"version",              no_argument,       0, 'v'},
         {"help",                 no_argument,       0, 'h'},
@@ -664,7 +1610,7 @@ int main(int argc, char **argv) {
     };
 
     while (c != -1) {
-        c = getopt_long(argc, argv, "CO:E::fuhv", flags, &option_idx);
+        c = getopt_long(argc, argv, "CO:E::K::L:R::Sfmruhv", flags, &option_idx);
         switch (c) {
             case 'C':
                 consider_crc_errors = 1;
@@ -682,9 +1628,34 @@ int main(int argc, char **argv) {
                 if (optarg != NULL)
                     read_offset = strtol(optarg, NULL, 0);
                 break;
+            case 'K':
+                checkpoint_bytes = CHECKPOINT_BYTES;
+                if (optarg != NULL)
+                    checkpoint_bytes = strtoull(optarg, NULL, 0);
+                /* At least one chunk between two checkpoints */
+                if (checkpoint_bytes == 0)
+                    checkpoint_bytes = 1;
+                break;
+            case 'L':
+                corruption_list_path = optarg;
+                break;
+            case 'R':
+                repair_chunks = 1;
+                if (optarg != NULL)
+                    repair_budget_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                sparse_output = 1;
+                break;
             case 'f':
                 firefox_crc = 1;
                 break;
+            case 'm':
+                mapped_output = 1;
+                break;
+            case 'r':
+                resume = 1;
+                break;
             case 'u':
                 unframed_stream = 1;
                 break;
@@ -709,6 +1680,10 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Keep on checkpointing a resumed decompression */
+    if (resume && checkpoint_bytes == 0)
+        checkpoint_bytes = CHECKPOINT_BYTES;
+
 #ifdef __AFL_LOOP
     while (__AFL_LOOP(UINT32_MAX)) {
 #endif
@@ -730,17 +1705,96 @@ int main(int argc, char **argv) {
         goto close_in;
     }
 
+    output_offset = 0;
+    output_crc = 0;
+    output_hole_pending = 0;
+    output_owned = is_owned_output(out);
+    /* Holes can only be left in files written only by snappy-fox */
+    if (sparse_output && !output_owned) {
+        prinfo("Output is not a file opened by snappy-fox, "
+               "disabling sparse output\n");
+        sparse_output = 0;
+    }
+
+    if (checkpoint_bytes != 0 &&
+        setup_checkpoint(argv[optind + 1], in, out) != 0) {
+        ret = 1;
+        goto free_checkpoint;
+    }
+
+    /* Keep only the regions listed before the checkpoint */
+    if (corruption_list_path != NULL && resume && checkpoint_list_size >= 0 &&
+        truncate(corruption_list_path, checkpoint_list_size) != 0 &&
+        errno != ENOENT) {
+        perror("truncate corruption list");
+        ret = 1;
+        goto free_checkpoint;
+    }
+
+    if (corruption_list_path != NULL) {
+        corruption_list = fopen(corruption_list_path,
+                                resume && checkpoint_list_size >= 0 ?
+                                "a" : "w");
+        if (corruption_list == NULL) {
+            perror("fopen corruption list");
+            ret = 1;
+            goto free_checkpoint;
+        }
+    }
+
+    /* stdout, pipes and sparse files are written through stdio */
+    output_mappable = mapped_output && !sparse_output && output_owned &&
+                      is_read_write(out);
+    if (mapped_output && !output_mappable)
+        prinfo("Output cannot be mapped, using buffered writes\n");
+
+    /* Unframed streams are sized once read */
+    if (output_mappable && unframed_stream == 0) {
+        /* Without a seekable input the mapping grows as needed */
+        total = is_regular_file(in) ? framed_output_length(in) : 0;
+        if (total < 0) {
+            perror("seek");
+            ret = 1;
+            goto close_list;
+        }
+        if (map_output(out, output_offset + total) != 0)
+            prinfo("Cannot map the output, using buffered writes\n");
+    }
+
     if (unframed_stream == 0)
         ret = snappy_decompress_framed(in, out);
     else
         ret = snappy_decompress_unframed(in, out);
 
+    if (unmap_output() != 0 || finalize_output(out) != 0) {
+        perror("finalize output");
+        ret = 1;
+    }
+
     if (ret != 0) {
         prerror("decompress %d\n", ret);
-        goto return_point;
+        goto close_list;
     }
 
-return_point:
+    /* Nothing left to resume */
+    if (checkpoint_path != NULL && unlink(checkpoint_path) != 0 &&
+        errno != ENOENT)
+        perror("unlink checkpoint");
+
+close_list:
+    if (corruption_list != NULL) {
+        discard_corrupted_regions();
+        flush_corrupted_region();
+        if (fclose(corruption_list) != 0)
+            perror("close");
+        corruption_list = NULL;
+    }
+    free(pending_regions);
+    pending_regions = NULL;
+    pending_regions_size = 0;
+free_checkpoint:
+    free(checkpoint_path);
+    checkpoint_path = NULL;
     if (close_file(out) != 0)
         perror("close");
 close_in:
@@ -47,5 +47,226 @@ test001() {
 	echo "[Test 001  ] ok"
 }
 
+test002() {
+	echo "[Test 002  ] check sparse output and corruption list"
+	cd ..
+	tmpdir="$(mktemp -d)"
+	# Corrupt the offset of a copy element
+	cp example/exampleimage.snappy "$tmpdir/corrupted.snappy"
+	printf '\377' | dd of="$tmpdir/corrupted.snappy" bs=1 seek=113 \
+		conv=notrunc 2>/dev/null
+
+	echo "[Test 002 a] Sparse output"
+	./snappy-fox --sparse \
+		example/exampleimage.snappy "$tmpdir/sparse.jpg"
+	cmp "$tmpdir/sparse.jpg" example/exampleimage.jpg
+
+	echo "[Test 002 b] Sparse output with zero substitution byte"
+	./snappy-fox --ignore_offset_errors=0 \
+		"$tmpdir/corrupted.snappy" "$tmpdir/dense.jpg"
+	./snappy-fox --ignore_offset_errors=0 --sparse \
+		"$tmpdir/corrupted.snappy" "$tmpdir/sparse.jpg"
+	cmp "$tmpdir/sparse.jpg" "$tmpdir/dense.jpg"
+
+	echo "[Test 002 c] Holes in zero runs"
+	# Unframed stream: "hello", 12800 zeros, "world", zeros up to 32 KiB
+	{
+		printf '\020hello\000\000'
+		i=0; while [ $i -lt 200 ]; do printf '\376\001\000'; i=$((i + 1)); done
+		printf '\020world\000\000'
+		i=0; while [ $i -lt 311 ]; do printf '\376\001\000'; i=$((i + 1)); done
+		printf '\316\001\000'
+	} > "$tmpdir/zeros.raw"
+	./snappy-fox --unframed "$tmpdir/zeros.raw" "$tmpdir/dense.bin"
+	./snappy-fox --unframed --sparse "$tmpdir/zeros.raw" "$tmpdir/sparse.bin"
+	test "$(stat -c %s "$tmpdir/dense.bin")" -eq 32768
+	cmp "$tmpdir/sparse.bin" "$tmpdir/dense.bin"
+	test "$(stat -c %b "$tmpdir/sparse.bin")" -lt \
+		"$(stat -c %b "$tmpdir/dense.bin")"
+
+	echo "[Test 002 d] Corruption list"
+	./snappy-fox --ignore_offset_errors=0 \
+		--corruption_list "$tmpdir/list.txt" \
+		"$tmpdir/corrupted.snappy" "$tmpdir/dense.jpg"
+	grep -q '^89 4$' "$tmpdir/list.txt"
+	./snappy-fox --corruption_list "$tmpdir/list.txt" \
+		example/exampleimage.snappy "$tmpdir/clean.jpg"
+	test ! -s "$tmpdir/list.txt"
+	# The corrupted chunk is rejected, so nothing of it is listed
+	if ./snappy-fox --firefox --consider_crc_errors \
+		--ignore_offset_errors=0 --corruption_list "$tmpdir/list.txt" \
+		"$tmpdir/corrupted.snappy" "$tmpdir/dense.jpg"; then
+		false
+	fi
+	test ! -s "$tmpdir/list.txt"
+
+	rm -rf "$tmpdir"
+	echo "[Test 002  ] ok"
+}
+
+test003() {
+	echo "[Test 003  ] check repair of corrupted chunks"
+	cd ..
+	tmpdir="$(mktemp -d)"
+
+	echo "[Test 003 a] Repair of an offset error"
+	cp example/exampleimage.snappy "$tmpdir/offset.snappy"
+	printf '\377' | dd of="$tmpdir/offset.snappy" bs=1 seek=113 \
+		conv=notrunc 2>/dev/null
+	./snappy-fox --firefox --repair \
+		"$tmpdir/offset.snappy" "$tmpdir/offset.jpg"
+	cmp "$tmpdir/offset.jpg" example/exampleimage.jpg
+
+	echo "[Test 003 b] Repair of a CRC error"
+	cp example/exampleimage.snappy "$tmpdir/crc.snappy"
+	byte="$(od -An -tu1 -j40 -N1 "$tmpdir/crc.snappy")"
+	printf "$(printf '\\%03o' $((byte ^ 4)))" | \
+		dd of="$tmpdir/crc.snappy" bs=1 seek=40 conv=notrunc 2>/dev/null
+	./snappy-fox --firefox --consider_crc_errors --repair \
+		"$tmpdir/crc.snappy" "$tmpdir/crc.jpg"
+	cmp "$tmpdir/crc.jpg" example/exampleimage.jpg
+
+	echo "[Test 003 c] Unrepairable chunk with offset errors ignored"
+	./snappy-fox --ignore_offset_errors \
+		"$tmpdir/offset.snappy" "$tmpdir/ignored.jpg"
+	./snappy-fox --repair=100 --ignore_offset_errors \
+		"$tmpdir/offset.snappy" "$tmpdir/offset.jpg"
+	cmp "$tmpdir/offset.jpg" "$tmpdir/ignored.jpg"
+
+	echo "[Test 003 d] No repair search with the wrong CRC algorithm"
+	# The second copy of the image has an offset error in its first chunk
+	cp example/exampleimage.snappy "$tmpdir/double.snappy"
+	tail -c +11 "$tmpdir/offset.snappy" >> "$tmpdir/double.snappy"
+	./snappy-fox --ignore_offset_errors \
+		"$tmpdir/double.snappy" "$tmpdir/ignored.jpg"
+	./snappy-fox --repair --ignore_offset_errors \
+		"$tmpdir/double.snappy" "$tmpdir/double.jpg" \
+		2> "$tmpdir/repair.log"
+	cmp "$tmpdir/double.jpg" "$tmpdir/ignored.jpg"
+	test "$(grep -c 'Every chunk fails the CRC' "$tmpdir/repair.log")" -eq 1
+	if grep -q 'REPAIR' "$tmpdir/repair.log"; then
+		false
+	fi
+
+	rm -rf "$tmpdir"
+	echo "[Test 003  ] ok"
+}
+
+test004() {
+	echo "[Test 004  ] check checkpoint and resume"
+	cd ..
+	tmpdir="$(mktemp -d)"
+	# Two copies of the image in a single stream
+	cp example/exampleimage.snappy "$tmpdir/double.snappy"
+	tail -c +11 example/exampleimage.snappy >> "$tmpdir/double.snappy"
+	cat example/exampleimage.jpg example/exampleimage.jpg \
+		> "$tmpdir/double.jpg"
+	# Corrupt the first chunk of the second copy
+	cp "$tmpdir/double.snappy" "$tmpdir/corrupted.snappy"
+	printf '\377' | dd of="$tmpdir/corrupted.snappy" bs=1 \
+		seek=$((167798 + 103)) conv=notrunc 2>/dev/null
+
+	echo "[Test 004 a] Interrupted decompression"
+	if ./snappy-fox --checkpoint=1 \
+		"$tmpdir/corrupted.snappy" "$tmpdir/out.jpg"; then
+		false
+	fi
+	grep -q '^167798 167816 ' "$tmpdir/out.jpg.checkpoint"
+
+	echo "[Test 004 b] Resumed decompression"
+	./snappy-fox --resume "$tmpdir/double.snappy" "$tmpdir/out.jpg"
+	cmp "$tmpdir/out.jpg" "$tmpdir/double.jpg"
+	test ! -e "$tmpdir/out.jpg.checkpoint"
+
+	echo "[Test 004 c] Resume on altered output"
+	if ./snappy-fox --checkpoint=1 \
+		"$tmpdir/corrupted.snappy" "$tmpdir/out.jpg"; then
+		false
+	fi
+	printf 'x' | dd of="$tmpdir/out.jpg" bs=1 seek=100 \
+		conv=notrunc 2>/dev/null
+	if ./snappy-fox --resume "$tmpdir/double.snappy" "$tmpdir/out.jpg"; then
+		false
+	fi
+
+	echo "[Test 004 d] Corruption list of a resumed decompression"
+	# Both copies of the image are corrupted in their first chunk
+	cp "$tmpdir/corrupted.snappy" "$tmpdir/twice.snappy"
+	printf '\377' | dd of="$tmpdir/twice.snappy" bs=1 seek=113 \
+		conv=notrunc 2>/dev/null
+	# Stop with an unsupported chunk after the fourth chunk
+	head -c $((167798 + 65480)) "$tmpdir/twice.snappy" \
+		> "$tmpdir/stopped.snappy"
+	printf '\001' >> "$tmpdir/stopped.snappy"
+	if ./snappy-fox --checkpoint=150000 --ignore_offset_errors=0 \
+		--corruption_list "$tmpdir/list.txt" \
+		"$tmpdir/stopped.snappy" "$tmpdir/out.jpg"; then
+		false
+	fi
+	./snappy-fox --resume --checkpoint=150000 --ignore_offset_errors=0 \
+		--corruption_list "$tmpdir/list.txt" \
+		"$tmpdir/twice.snappy" "$tmpdir/out.jpg"
+	printf '89 4\n167905 4\n' | cmp - "$tmpdir/list.txt"
+
+	echo "[Test 004 e] Checkpoint of an output appended to stdout"
+	if ./snappy-fox --checkpoint example/exampleimage.snappy - \
+		>> "$tmpdir/append.jpg"; then
+		false
+	fi
+	test ! -e ./-.checkpoint
+
+	rm -rf "$tmpdir"
+	echo "[Test 004  ] ok"
+}
+
+test005() {
+	echo "[Test 005  ] check mapped and buffered output"
+	cd ..
+	tmpdir="$(mktemp -d)"
+
+	echo "[Test 005 a] Framed stream"
+	./snappy-fox --mmap \
+		example/exampleimage.snappy "$tmpdir/mapped.jpg"
+	cmp "$tmpdir/mapped.jpg" example/exampleimage.jpg
+	./snappy-fox --mmap - "$tmpdir/mapped.jpg" \
+		< example/exampleimage.snappy
+	cmp "$tmpdir/mapped.jpg" example/exampleimage.jpg
+
+	echo "[Test 005 b] Framed stream longer than its prescan"
+	# A stray skippable chunk type stops the prescan after a chunk
+	head -c 65490 example/exampleimage.snappy > "$tmpdir/stray.snappy"
+	printf '\047' >> "$tmpdir/stray.snappy"
+	tail -c +65491 example/exampleimage.snappy >> "$tmpdir/stray.snappy"
+	./snappy-fox --mmap "$tmpdir/stray.snappy" "$tmpdir/mapped.jpg"
+	cmp "$tmpdir/mapped.jpg" example/exampleimage.jpg
+
+	echo "[Test 005 c] Unframed stream"
+	# Elements of the first chunk, without the uncompressed length
+	tail -c +22 example/exampleimage.snappy | head -c 65469 \
+		> "$tmpdir/unframed.raw"
+	head -c 65536 example/exampleimage.jpg > "$tmpdir/unframed.ref"
+	./snappy-fox --mmap --unframed \
+		"$tmpdir/unframed.raw" "$tmpdir/mapped.bin"
+	cmp "$tmpdir/mapped.bin" "$tmpdir/unframed.ref"
+	./snappy-fox --unframed "$tmpdir/unframed.raw" - \
+		| cmp - "$tmpdir/unframed.ref"
+
+	echo "[Test 005 d] Output appended to stdout"
+	for flags in "" "--mmap" "--sparse"; do
+		echo hello > "$tmpdir/append.jpg"
+		./snappy-fox $flags example/exampleimage.snappy - \
+			>> "$tmpdir/append.jpg"
+		echo hello | cat - example/exampleimage.jpg \
+			| cmp - "$tmpdir/append.jpg"
+	done
+
+	rm -rf "$tmpdir"
+	echo "[Test 005  ] ok"
+}
+
 ( test000 )
 ( test001 )
+( test002 )
+( test003 )
+( test004 )
+( test005 )